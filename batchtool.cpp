@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QMutex>
+#include <QPair>
+#include <QRunnable>
+#include <QSizeF>
+#include <QStringList>
+#include <QTextStream>
+#include <QThreadPool>
+
+#include "imageencoder.h"
+#include "intermediatecache.h"
+#include "sailfishsilicabackground.h"
+
+namespace {
+struct Variant {
+    QSizeF size;
+    double pixelRatio;
+    QString outputPath;
+};
+
+// Pinned so the output does not depend on the dconf settings of the build host
+struct BlurSettings {
+    int rounds;
+    int radius;
+    double sigma;
+};
+
+// Results shared by all jobs
+class Report {
+public:
+    Report() : m_megapixels(0.0), m_skipped(0), m_failed(0) {}
+
+    void addImage(const QString& path, const Variant& variant, qint64 outputPixels,
+                  double decodeMs, double processMs);
+    void addSkipped() { QMutexLocker locker(&m_mutex); ++m_skipped; }
+    void addFailed(const QString& path, const QString& errorString);
+    void print(double wallMs);
+    int failed() { QMutexLocker locker(&m_mutex); return m_failed; }
+
+private:
+    QMutex m_mutex;
+    std::vector<double> m_latencies;
+    double m_megapixels;
+    int m_skipped;
+    int m_failed;
+};
+
+// decodeMs is zero for variants sharing an image decoded for an earlier one
+void Report::addImage(const QString& path, const Variant& variant, qint64 outputPixels,
+                      double decodeMs, double processMs)
+{
+    const double megapixels = outputPixels / 1e6;
+    const double latencyMs = decodeMs + processMs;
+
+    QMutexLocker locker(&m_mutex);
+    m_latencies.push_back(latencyMs);
+    m_megapixels += megapixels;
+    printf("%s %gx%g@%g: decode %.1f ms, process+encode %.1f ms, %.2f output MP/s\n",
+           qPrintable(path), variant.size.width(), variant.size.height(), variant.pixelRatio,
+           decodeMs, processMs, megapixels / (latencyMs / 1000.0));
+    fflush(stdout);
+}
+
+void Report::addFailed(const QString& path, const QString& errorString)
+{
+    QMutexLocker locker(&m_mutex);
+    ++m_failed;
+    fprintf(stderr, "%s: %s\n", qPrintable(path), qPrintable(errorString));
+}
+
+void Report::print(double wallMs)
+{
+    QMutexLocker locker(&m_mutex);
+    printf("%d generated, %d up to date, %d failed in %.1f s\n",
+           int(m_latencies.size()), m_skipped, m_failed, wallMs / 1000.0);
+    if (m_latencies.empty()) {
+        return;
+    }
+
+    std::sort(m_latencies.begin(), m_latencies.end());
+    auto percentile = [this](double p) {
+        const size_t index = static_cast<size_t>(std::ceil(p * m_latencies.size()));
+        return m_latencies[std::max<size_t>(1, index) - 1];
+    };
+    printf("Throughput %.2f output MP/s\n", m_megapixels / (wallMs / 1000.0));
+    printf("Latency p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           percentile(0.5), percentile(0.9), percentile(0.99), m_latencies.back());
+}
+
+// Decodes one image for one target size and generates all pixel ratios of it.
+// Jobs run concurrently, so decoding, processing and encoding of different
+// images overlap.
+class ImageJob : public QRunnable {
+public:
+    ImageJob(const QString& path, const QString& devicePath, const QSizeF& size,
+             const QList<Variant>& variants, const BlurSettings& blur, const QImage& texture,
+             bool force, Report* report)
+        : m_path(path), m_devicePath(devicePath), m_size(size), m_variants(variants),
+          m_blur(blur), m_texture(texture), m_force(force), m_report(report) {}
+
+    void run() override;
+
+private:
+    QString m_path;
+    QString m_devicePath;  // Path the library sees at runtime, names the output
+    QSizeF m_size;
+    QList<Variant> m_variants;
+    BlurSettings m_blur;
+    QImage m_texture;
+    bool m_force;
+    Report* m_report;
+};
+
+void ImageJob::run()
+{
+    const QFileInfo input(m_path);
+
+    // Skip outputs which are newer than the input
+    QList<Variant> pending;
+    for (const Variant& variant : m_variants) {
+        const QFileInfo output(SailfishSilicaBackground::portraitImagePath(variant.outputPath, m_devicePath));
+        if (!m_force && output.exists() && output.lastModified() >= input.lastModified()) {
+            m_report->addSkipped();
+        } else {
+            pending.append(variant);
+        }
+    }
+    if (pending.isEmpty()) {
+        return;
+    }
+
+    const QRectF appRect(QPointF(0, 0), m_size);
+    QElapsedTimer timer;
+    timer.start();
+
+    SailfishSilicaBackground decoder(QString{});
+    const QImage image = decoder.getAppBackground(m_path, appRect);
+    double decodeMs = timer.nsecsElapsed() / 1e6;
+    if (image.isNull()) {
+        m_report->addFailed(m_path, QStringLiteral("Failed to read image"));
+        return;
+    }
+
+    for (const Variant& variant : pending) {
+        timer.restart();
+
+        // All cores are already busy with other jobs
+        SailfishSilicaBackground filter(variant.outputPath);
+        filter.setPixelRatio(variant.pixelRatio);
+        filter.setBlurRounds(m_blur.rounds);
+        filter.setBlurRadius(m_blur.radius);
+        filter.setBlurSigma(m_blur.sigma);
+        filter.setMaxThreads(1);
+
+        QImage outputImage;
+        filter.buildBackgroundImageBase(image, outputImage, m_texture, appRect);
+        const ImageEncoder::Result result = ImageEncoder::encode(outputImage,
+                SailfishSilicaBackground::portraitImagePath(variant.outputPath, m_devicePath),
+                ImageEncoder::Options());
+
+        if (result.ok) {
+            m_report->addImage(m_path, variant, qint64(outputImage.width()) * outputImage.height(),
+                               decodeMs, timer.nsecsElapsed() / 1e6);
+        } else {
+            m_report->addFailed(result.path, result.errorString);
+        }
+
+        // The decode is charged to the first variant only
+        decodeMs = 0.0;
+    }
+}
+
+QStringList imagesInDirectory(const QString& path)
+{
+    QStringList nameFilters;
+    for (const QByteArray& format : QImageReader::supportedImageFormats()) {
+        nameFilters.append(QStringLiteral("*.") + QString::fromLatin1(format));
+    }
+
+    QStringList images;
+    QDirIterator it(path, nameFilters, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        images.append(it.next());
+    }
+    images.sort();
+    return images;
+}
+
+// Maps a local path to the path of the installed image, using the longest
+// matching local prefix
+QString devicePath(const QString& path, const QList<QPair<QString, QString>>& pathMap)
+{
+    const QString absolutePath = QDir::cleanPath(QFileInfo(path).absoluteFilePath());
+
+    const QPair<QString, QString>* match = nullptr;
+    for (const QPair<QString, QString>& mapping : pathMap) {
+        const QString& prefix = mapping.first;
+        if ((absolutePath == prefix || absolutePath.startsWith(prefix + QLatin1Char('/')))
+                && (!match || prefix.length() > match->first.length())) {
+            match = &mapping;
+        }
+    }
+
+    return match ? match->second + absolutePath.mid(match->first.length()) : absolutePath;
+}
+
+bool imagesInList(const QString& path, QStringList* images)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        fprintf(stderr, "Failed to open file list %s: %s\n",
+                qPrintable(path), qPrintable(file.errorString()));
+        return false;
+    }
+
+    QTextStream stream(&file);
+    while (!stream.atEnd()) {
+        const QString line = stream.readLine().trimmed();
+        if (!line.isEmpty() && !line.startsWith(QLatin1Char('#'))) {
+            images->append(line);
+        }
+    }
+    return true;
+}
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("sailfishsilicabackground-batch"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Generates app backgrounds for a set of wallpapers."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("inputs"), QStringLiteral("Image files or directories."), QStringLiteral("[inputs...]"));
+
+    QCommandLineOption listOption(QStringLiteral("list"), QStringLiteral("Read image paths from <file>, one per line."), QStringLiteral("file"));
+    QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Write backgrounds below <dir>."), QStringLiteral("dir"), QStringLiteral("."));
+    QCommandLineOption sizeOption(QStringLiteral("size"), QStringLiteral("Target size, e.g. 1080x1920. Can be repeated."), QStringLiteral("WxH"));
+    QCommandLineOption ratioOption(QStringLiteral("ratio"), QStringLiteral("Pixel ratio. Can be repeated, defaults to 1."), QStringLiteral("ratio"));
+    QCommandLineOption threadsOption(QStringLiteral("threads"), QStringLiteral("Number of images processed in parallel."), QStringLiteral("count"));
+    QCommandLineOption noTextureOption(QStringLiteral("no-texture"), QStringLiteral("Do not overlay the background texture."));
+    QCommandLineOption forceOption(QStringLiteral("force"), QStringLiteral("Regenerate up to date outputs."));
+    QCommandLineOption pathMapOption(QStringLiteral("path-map"),
+            QStringLiteral("Output file names are hashed from the image path the device sees at runtime. "
+                           "Maps the local directory <local> to the installed directory <device>, "
+                           "e.g. ./wallpapers=/usr/share/wallpapers. Can be repeated. "
+                           "Unmapped images use their absolute local path."),
+            QStringLiteral("local=device"));
+    QCommandLineOption blurRoundsOption(QStringLiteral("blur-rounds"),
+            QStringLiteral("Blur rounds, defaults to 5. The blur settings of the host's "
+                           "silica-background dconf group are not used."),
+            QStringLiteral("rounds"), QStringLiteral("5"));
+    QCommandLineOption blurRadiusOption(QStringLiteral("blur-radius"), QStringLiteral("Blur kernel radius, defaults to 4."), QStringLiteral("radius"), QStringLiteral("4"));
+    QCommandLineOption blurSigmaOption(QStringLiteral("blur-sigma"), QStringLiteral("Blur kernel sigma, defaults to 1.2."), QStringLiteral("sigma"), QStringLiteral("1.2"));
+    parser.addOptions({ listOption, outputOption, sizeOption, ratioOption, threadsOption, noTextureOption, forceOption, pathMapOption,
+                        blurRoundsOption, blurRadiusOption, blurSigmaOption });
+    parser.process(app);
+
+    // Collect inputs
+    QStringList images;
+    for (const QString& input : parser.positionalArguments()) {
+        if (QFileInfo(input).isDir()) {
+            images += imagesInDirectory(input);
+        } else {
+            images.append(input);
+        }
+    }
+    for (const QString& list : parser.values(listOption)) {
+        if (!imagesInList(list, &images)) {
+            return 1;
+        }
+    }
+
+    // Parse target sizes and pixel ratios
+    QList<QSizeF> sizes;
+    for (const QString& value : parser.values(sizeOption)) {
+        const QStringList parts = value.split(QLatin1Char('x'));
+        const double width = parts.value(0).toDouble();
+        const double height = parts.value(1).toDouble();
+        if (parts.size() != 2 || width <= 0 || height <= 0) {
+            fprintf(stderr, "Invalid size %s\n", qPrintable(value));
+            return 1;
+        }
+        sizes.append(QSizeF(width, height));
+    }
+
+    QList<double> ratios;
+    for (const QString& value : parser.values(ratioOption)) {
+        const double ratio = value.toDouble();
+        if (ratio <= 0) {
+            fprintf(stderr, "Invalid pixel ratio %s\n", qPrintable(value));
+            return 1;
+        }
+        ratios.append(ratio);
+    }
+    if (ratios.isEmpty()) {
+        ratios.append(1.0);
+    }
+
+    BlurSettings blur;
+    blur.rounds = parser.value(blurRoundsOption).toInt();
+    blur.radius = parser.value(blurRadiusOption).toInt();
+    blur.sigma = parser.value(blurSigmaOption).toDouble();
+    if (blur.rounds < 0 || blur.radius < 1 || blur.sigma <= 0) {
+        fprintf(stderr, "Invalid blur settings\n");
+        return 1;
+    }
+
+    QList<QPair<QString, QString>> pathMap;
+    for (const QString& value : parser.values(pathMapOption)) {
+        const int separator = value.indexOf(QLatin1Char('='));
+        if (separator <= 0 || separator == value.length() - 1) {
+            fprintf(stderr, "Invalid path mapping %s\n", qPrintable(value));
+            return 1;
+        }
+        pathMap.append(qMakePair(QDir::cleanPath(QFileInfo(value.left(separator)).absoluteFilePath()),
+                                 QDir::cleanPath(value.mid(separator + 1))));
+    }
+
+    if (images.isEmpty() || sizes.isEmpty()) {
+        parser.showHelp(1);
+    }
+
+    // Every image is processed only once per variant, caching would only cost memory
+    IntermediateCache::instance()->setMaxBytes(0);
+
+    SailfishSilicaBackground textureLoader(QString{});
+    const QImage texture = parser.isSet(noTextureOption) ? QImage() : textureLoader.backgroundTexture();
+    const QString outputRoot = parser.value(outputOption);
+
+    QThreadPool threadPool;
+    if (parser.isSet(threadsOption)) {
+        threadPool.setMaxThreadCount(std::max(1, parser.value(threadsOption).toInt()));
+    }
+
+    Report report;
+    QElapsedTimer timer;
+    timer.start();
+
+    for (const QSizeF& size : sizes) {
+        QList<Variant> variants;
+        for (double ratio : ratios) {
+            const QString outputPath = QStringLiteral("%1/%2x%3@%4").arg(outputRoot)
+                    .arg(size.width()).arg(size.height()).arg(ratio);
+            variants.append(Variant{ size, ratio, QDir::cleanPath(outputPath) });
+        }
+
+        for (const QString& image : images) {
+            threadPool.start(new ImageJob(image, devicePath(image, pathMap), size, variants,
+                                          blur, texture, parser.isSet(forceOption), &report));
+        }
+    }
+
+    threadPool.waitForDone();
+    report.print(timer.nsecsElapsed() / 1e6);
+
+    return report.failed() > 0 ? 1 : 0;
+}
@@ -3,7 +3,8 @@
 #include <cmath>
 #include <cstdint>
 #include <QImage>
-#include <QThreadPool>
+
+#include "scanlineexecutor.h"
 
 GaussianBlurCalculator::GaussianBlurCalculator(int radius, double sigma) :
     m_radius(radius),
@@ -40,39 +41,19 @@ GaussianBlurCalculator::GaussianBlurCalculator(int radius, double sigma) :
     delete[] gaussianValues;
 }
 
-void GaussianBlurCalculator::BlurTask::run()
-{
-    // Process lines in range
-    for (int y = m_startLine; y < m_startLine + m_lineCount; y++) {
-        m_calc->blurAndDownsample(m_source, m_dest, y);
-    }
-}
-
-GaussianBlurCalculator::BlurTask::BlurTask(GaussianBlurCalculator* calc, const QImage* src,
-                                           QImage* dst, int start, int count)
-    : QRunnable(), 
-      m_calc(calc), m_source(src), m_dest(dst), m_startLine(start), m_lineCount(count)
-{
-    setAutoDelete(false);
-}
-
-void GaussianBlurCalculator::blurAndDownsample(const QImage* source, QImage* dest, int row) {
+void GaussianBlurCalculator::blurAndDownsample(const QImage* source, QRgb* destBits,
+                                               int destWidth, int destHeight, int row) {
     // Get source row data
     int sourceWidth = source->width();
     const auto* srcLine = reinterpret_cast<const QRgb*>(source->scanLine(row));
     
-    // Get destination base pointer for column-wise writing
-    auto* destBits = reinterpret_cast<QRgb*>(dest->bits());
-    int destWidth = dest->width();
-    int destHeight = dest->height();
-    
     int kernelOffset = m_radius - 1;
 
     // Process each pixel in the row and write transposed
     for (int x = 0; x < std::min(sourceWidth, destHeight); ++x) {
         // Calculate kernel bounds
         int kernelStart = std::max(0, (kernelOffset - x));
-        int kernelEnd = std::min(sourceWidth - x, m_kernelSize);
+        int kernelEnd = std::min(sourceWidth - x + kernelOffset, m_kernelSize);
 
         // Calculate weighted sum of pixels
         uint64_t redSum = 0, greenSum = 0, blueSum = 0;
@@ -97,39 +78,28 @@ void GaussianBlurCalculator::blurAndDownsample(const QImage* source, QImage* des
     }
 }
 
-void GaussianBlurCalculator::blurAndTranspose(const QImage* src, QImage* dst)
+void GaussianBlurCalculator::blurAndTranspose(const QImage* src, QImage* dst,
+                                              ScanlineExecutor* executor)
 {
     // Quick validation
     if (!src || src->isNull()) {
         return;
     }
 
-    // Setup thread pool for parallel processing
-    QThreadPool threadPool;
-    int threadCount = QThread::idealThreadCount();
-    int linesPerThread = src->height() / threadCount;
-
-    // Create list to track blur tasks
-    QList<BlurTask*> tasks;
-    int startLine = 0;
-
-    // Create and queue blur tasks for all but last section
-    for (int i = 0; i < threadCount - 1; i++) {
-        BlurTask* task = new BlurTask(this, src, dst, startLine, linesPerThread);
-        tasks.append(task);
-        threadPool.start(task, 0);
-
-        startLine += linesPerThread;
-    }
-    
-    // Process remaining lines directly
-    for (int y = startLine; y < src->height(); y++) {
-        blurAndDownsample(src, dst, y);
+    // Destination is the transpose of the source
+    const QSize destSize(src->height(), src->width());
+    if (dst->size() != destSize || dst->format() != src->format()) {
+        *dst = QImage(destSize, src->format());
     }
 
-    // Wait for tasks to complete
-    threadPool.waitForDone();
+    // Detach once here, workers only write through the pointer
+    auto* destBits = reinterpret_cast<QRgb*>(dst->bits());
+    const int destWidth = dst->width();
+    const int destHeight = dst->height();
 
-    // Cleanup tasks
-    qDeleteAll(tasks);
+    executor->run(*src, [&](int startLine, int lineCount) {
+        for (int y = startLine; y < startLine + lineCount; y++) {
+            blurAndDownsample(src, destBits, destWidth, destHeight, y);
+        }
+    });
 }
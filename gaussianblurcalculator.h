@@ -2,8 +2,8 @@
 #define GAUSSIANBLURCALCULATOR_H
 
 #include <QImage>
-#include <QRunnable>
-#include <QMutex>
+
+class ScanlineExecutor;
 
 class GaussianBlurCalculator {
 private:
@@ -12,23 +12,6 @@ private:
     int* m_weights;    // Gaussian kernel weights
     int* m_runningSums;       // Running sums for normalization
 
-    // Task class for parallel processing
-    class BlurTask : public QRunnable {
-    private:
-        GaussianBlurCalculator* m_calc;
-        const QImage* m_source;
-        QImage* m_dest;
-        int m_startLine;
-        int m_lineCount;
-
-        virtual void run() override;
-
-    public:
-        friend class GaussianBlurCalculator;
-        BlurTask(GaussianBlurCalculator* calc, const QImage* src,
-                 QImage* dst, int start, int count);
-    };
-
 public:
     // Constructor - initializes Gaussian kernel
     GaussianBlurCalculator(int radius, double sigma);
@@ -39,9 +22,11 @@ public:
         delete[] m_runningSums;
     }
 
-    // Blur methods
-    void blurAndDownsample(const QImage* src, QImage* dst, int line);
-    void blurAndTranspose(const QImage* src, QImage* dst);
+    // Blur methods - dst is resized to the transpose of src when needed,
+    // lines are processed on the threads of executor
+    void blurAndDownsample(const QImage* src, QRgb* destBits, int destWidth,
+                           int destHeight, int line);
+    void blurAndTranspose(const QImage* src, QImage* dst, ScanlineExecutor* executor);
 };
 
 #endif // GAUSSIANBLURCALCULATOR_H
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "imageencoder.h"
+
+#include <algorithm>
+#include <deque>
+#include <QCoreApplication>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QThread>
+#include <QWaitCondition>
+
+class ImageEncoderPrivate {
+public:
+    struct Job {
+        QImage image;
+        QString path;
+        ImageEncoder::Options options;
+        std::promise<ImageEncoder::Result> promise;
+    };
+
+    // Thread writing queued images
+    class EncoderThread : public QThread {
+    private:
+        ImageEncoderPrivate* m_encoder;
+
+        virtual void run() override;
+
+    public:
+        explicit EncoderThread(ImageEncoderPrivate* encoder);
+    };
+
+    explicit ImageEncoderPrivate(int maxQueued);
+
+    int m_maxQueued;
+    bool m_stopping;
+    bool m_busy;
+    QMutex m_mutex;
+    QWaitCondition m_jobAdded;
+    QWaitCondition m_jobTaken;
+    QWaitCondition m_idle;
+    std::deque<Job> m_queue;
+    EncoderThread m_thread;
+};
+
+Q_GLOBAL_STATIC(ImageEncoder, globalImageEncoder)
+
+namespace {
+// Runs while QCoreApplication is destroyed, before image plugins go away
+void flushGlobalImageEncoder()
+{
+    if (globalImageEncoder.exists()) {
+        globalImageEncoder()->waitForDone();
+    }
+}
+}
+
+ImageEncoderPrivate::ImageEncoderPrivate(int maxQueued) :
+    m_maxQueued(std::max(1, maxQueued)),
+    m_stopping(false),
+    m_busy(false),
+    m_thread(this)
+{
+}
+
+ImageEncoder* ImageEncoder::instance()
+{
+    static const bool flushRegistered = [] {
+        qAddPostRoutine(flushGlobalImageEncoder);
+        return true;
+    }();
+    Q_UNUSED(flushRegistered)
+
+    return globalImageEncoder();
+}
+
+ImageEncoder::ImageEncoder(int maxQueued) :
+    d(new ImageEncoderPrivate(maxQueued))
+{
+    d->m_thread.start();
+}
+
+ImageEncoder::~ImageEncoder()
+{
+    std::deque<ImageEncoderPrivate::Job> discarded;
+    {
+        QMutexLocker locker(&d->m_mutex);
+        d->m_stopping = true;
+        d->m_queue.swap(discarded);
+        d->m_jobAdded.wakeAll();
+        d->m_jobTaken.wakeAll();
+    }
+    d->m_thread.wait();
+
+    // Writing now could use image plugins already destroyed at exit
+    for (ImageEncoderPrivate::Job& job : discarded) {
+        Result result;
+        result.path = job.path;
+        result.errorString = QStringLiteral("Encoder destroyed before the image was written");
+        job.promise.set_value(result);
+    }
+
+    delete d;
+}
+
+void ImageEncoder::waitForDone()
+{
+    QMutexLocker locker(&d->m_mutex);
+    while (!d->m_queue.empty() || d->m_busy) {
+        d->m_idle.wait(&d->m_mutex);
+    }
+}
+
+ImageEncoder::Result ImageEncoder::encode(const QImage& image, const QString& path,
+        const Options& options)
+{
+    Result result;
+    result.path = path;
+
+    // QSaveFile writes to a temporary file and renames it into place on commit
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        result.errorString = file.errorString();
+        return result;
+    }
+
+    QImageWriter writer(&file, QFileInfo(path).suffix().toLatin1());
+    writer.setQuality(options.quality);
+    writer.setOptimizedWrite(options.optimized);
+    writer.setProgressiveScanWrite(options.progressive);
+
+    // An uncommitted QSaveFile discards its temporary file
+    if (!writer.write(image)) {
+        result.errorString = writer.errorString();
+        return result;
+    }
+
+    if (!file.commit()) {
+        result.errorString = file.errorString();
+        return result;
+    }
+
+    result.ok = true;
+    return result;
+}
+
+std::future<ImageEncoder::Result> ImageEncoder::enqueue(const QImage& image,
+        const QString& path, const Options& options)
+{
+    ImageEncoderPrivate::Job job;
+    job.image = image;
+    job.path = path;
+    job.options = options;
+    std::future<Result> future = job.promise.get_future();
+
+    QMutexLocker locker(&d->m_mutex);
+    while (int(d->m_queue.size()) >= d->m_maxQueued) {
+        d->m_jobTaken.wait(&d->m_mutex);
+    }
+    d->m_queue.push_back(std::move(job));
+    d->m_jobAdded.wakeOne();
+
+    return future;
+}
+
+void ImageEncoderPrivate::EncoderThread::run()
+{
+    for (;;) {
+        Job job;
+        {
+            QMutexLocker locker(&m_encoder->m_mutex);
+            while (m_encoder->m_queue.empty() && !m_encoder->m_stopping) {
+                m_encoder->m_jobAdded.wait(&m_encoder->m_mutex);
+            }
+            if (m_encoder->m_queue.empty()) {
+                return;
+            }
+            job = std::move(m_encoder->m_queue.front());
+            m_encoder->m_queue.pop_front();
+            m_encoder->m_busy = true;
+            m_encoder->m_jobTaken.wakeOne();
+        }
+
+        job.promise.set_value(ImageEncoder::encode(job.image, job.path, job.options));
+
+        QMutexLocker locker(&m_encoder->m_mutex);
+        m_encoder->m_busy = false;
+        if (m_encoder->m_queue.empty()) {
+            m_encoder->m_idle.wakeAll();
+        }
+    }
+}
+
+ImageEncoderPrivate::EncoderThread::EncoderThread(ImageEncoderPrivate* encoder)
+    : QThread(),
+      m_encoder(encoder)
+{
+}
@@ -0,0 +1,54 @@
+#ifndef IMAGEENCODER_H
+#define IMAGEENCODER_H
+
+#include <QImage>
+#include <QString>
+
+#include <future>
+
+class ImageEncoderPrivate;
+
+class ImageEncoder {
+public:
+    // Encoder quality/speed trade-offs
+    struct Options {
+        int quality = 95;          // 0-100, higher is larger and slower
+        bool optimized = false;    // Optimize entropy coding, smaller but slower
+        bool progressive = false;  // Progressive scan
+    };
+
+    struct Result {
+        bool ok = false;
+        QString path;
+        QString errorString;
+    };
+
+    // Process wide instance shared by all filters. It is flushed when the
+    // QCoreApplication is destroyed; without one, call waitForDone() before
+    // leaving main().
+    static ImageEncoder* instance();
+
+    // Constructor - maxQueued is the number of images waiting to be written
+    explicit ImageEncoder(int maxQueued = 4);
+    // Destructor - images still queued are discarded with an error result
+    ~ImageEncoder();
+
+    // Encodes on the calling thread. The image is written to a temporary
+    // file which replaces path only once it is complete.
+    static Result encode(const QImage& image, const QString& path, const Options& options);
+
+    // Queues the image for encoding on the background thread, blocking
+    // while the queue is full
+    std::future<Result> enqueue(const QImage& image, const QString& path, const Options& options);
+
+    // Blocks until all queued images are written
+    void waitForDone();
+
+private:
+    // Queue and thread state, kept out of the public header
+    ImageEncoderPrivate* d;
+
+    Q_DISABLE_COPY(ImageEncoder)
+};
+
+#endif // IMAGEENCODER_H
@@ -0,0 +1,144 @@
+#include "intermediatecache.h"
+
+#include <algorithm>
+#include <QCryptographicHash>
+#include <QMutexLocker>
+
+Q_GLOBAL_STATIC(IntermediateCache, globalIntermediateCache)
+
+namespace {
+int imageCost(const QImage& image)
+{
+    return std::max<qint64>(1, qint64(image.bytesPerLine()) * image.height() / 1024);
+}
+
+QByteArray stageKey(IntermediateCache::Stage stage, const QByteArray& key)
+{
+    return QByteArray(1, char(stage)) + key;
+}
+}
+
+IntermediateCache* IntermediateCache::instance()
+{
+    return globalIntermediateCache();
+}
+
+IntermediateCache::IntermediateCache(qint64 maxBytes) :
+    m_images(maxBytes / 1024),
+    m_lastCacheKey(0)
+{
+    for (int i = 0; i < StageCount; ++i) {
+        m_hits[i] = 0;
+        m_misses[i] = 0;
+    }
+}
+
+QByteArray IntermediateCache::imageHash(const QImage& image)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_lastCacheKey != 0 && m_lastCacheKey == image.cacheKey()) {
+            return m_lastHash;
+        }
+    }
+
+    // Hash line by line to skip the padding at the end of each line
+    QCryptographicHash hasher(QCryptographicHash::Md5);
+    const int header[] = { image.width(), image.height(), int(image.format()) };
+    hasher.addData(reinterpret_cast<const char*>(header), sizeof(header));
+    const int lineBytes = (image.width() * image.depth() + 7) / 8;
+    for (int y = 0; y < image.height(); ++y) {
+        hasher.addData(reinterpret_cast<const char*>(image.scanLine(y)), lineBytes);
+    }
+    const QByteArray hash = hasher.result();
+
+    QMutexLocker locker(&m_mutex);
+    m_lastCacheKey = image.cacheKey();
+    m_lastHash = hash;
+    return hash;
+}
+
+bool IntermediateCache::isEnabled() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_images.maxCost() > 0;
+}
+
+bool IntermediateCache::find(Stage stage, const QByteArray& key, QImage* image)
+{
+    // An empty key means the caller built none, e.g. the cache was disabled
+    if (key.isEmpty()) {
+        return false;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (m_images.maxCost() <= 0) {
+        return false;
+    }
+
+    const QImage* cached = m_images.object(stageKey(stage, key));
+    if (!cached) {
+        ++m_misses[stage];
+        return false;
+    }
+
+    ++m_hits[stage];
+    *image = *cached;
+    return true;
+}
+
+void IntermediateCache::insert(Stage stage, const QByteArray& key, const QImage& image)
+{
+    if (key.isEmpty() || image.isNull()) {
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (m_images.maxCost() <= 0) {
+        return;
+    }
+    m_images.insert(stageKey(stage, key), new QImage(image), imageCost(image));
+}
+
+void IntermediateCache::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_images.clear();
+}
+
+void IntermediateCache::setMaxBytes(qint64 maxBytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_images.setMaxCost(maxBytes / 1024);
+}
+
+qint64 IntermediateCache::maxBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return qint64(m_images.maxCost()) * 1024;
+}
+
+qint64 IntermediateCache::usedBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return qint64(m_images.totalCost()) * 1024;
+}
+
+int IntermediateCache::hits(Stage stage) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_hits[stage];
+}
+
+int IntermediateCache::misses(Stage stage) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_misses[stage];
+}
+
+double IntermediateCache::hitRate(Stage stage) const
+{
+    QMutexLocker locker(&m_mutex);
+    const int lookups = m_hits[stage] + m_misses[stage];
+    return lookups > 0 ? m_hits[stage] / double(lookups) : 0.0;
+}
@@ -0,0 +1,51 @@
+#ifndef INTERMEDIATECACHE_H
+#define INTERMEDIATECACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QImage>
+#include <QMutex>
+
+class IntermediateCache {
+public:
+    // Pipeline stages whose results are cached
+    enum Stage {
+        ColorStage,  // Scaled image after blur, curves and saturation
+        StageCount
+    };
+
+    // Process wide instance shared by all filters
+    static IntermediateCache* instance();
+
+    explicit IntermediateCache(qint64 maxBytes = 32 * 1024 * 1024);
+
+    // Content hash of an image, remembered while the image is unmodified
+    QByteArray imageHash(const QImage& image);
+
+    // Lookup and store - images are implicitly shared, not copied.
+    // Both do nothing while the cache is disabled with a zero size, or
+    // for an empty key.
+    bool isEnabled() const;
+    bool find(Stage stage, const QByteArray& key, QImage* image);
+    void insert(Stage stage, const QByteArray& key, const QImage& image);
+    void clear();
+
+    void setMaxBytes(qint64 maxBytes);
+    qint64 maxBytes() const;
+    qint64 usedBytes() const;
+
+    // Statistics
+    int hits(Stage stage) const;
+    int misses(Stage stage) const;
+    double hitRate(Stage stage) const;
+
+private:
+    mutable QMutex m_mutex;
+    QCache<QByteArray, QImage> m_images;  // Cost in KiB
+    int m_hits[StageCount];
+    int m_misses[StageCount];
+    qint64 m_lastCacheKey;
+    QByteArray m_lastHash;
+};
+
+#endif // INTERMEDIATECACHE_H
@@ -3,13 +3,59 @@
 #include <cmath>
 #include <mdconfgroup.h>
 
+#include <QDataStream>
 #include <QDebug>
 #include <QDir>
+#include <QHash>
 #include <QImageReader>
-#include <QImageWriter>
+#include <QMutex>
 #include <QPainter>
 
 #include "gaussianblurcalculator.h"
+#include "intermediatecache.h"
+#include "scanlineexecutor.h"
+
+namespace {
+// SplitMix64 - advances state and returns a well mixed value, so rows
+// seeded with nearby states still get unrelated noise
+inline quint64 splitMix64(quint64& state)
+{
+    quint64 z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Executors are kept outside the class so its layout, and with it the
+// library ABI, stays unchanged
+struct ExecutorRegistry {
+    QMutex mutex;
+    QHash<const SailfishSilicaBackground*, ScanlineExecutor*> executors;
+};
+Q_GLOBAL_STATIC(ExecutorRegistry, executorRegistry)
+
+ScanlineExecutor* executorFor(const SailfishSilicaBackground* filter)
+{
+    ExecutorRegistry* registry = executorRegistry();
+    QMutexLocker locker(&registry->mutex);
+    ScanlineExecutor*& executor = registry->executors[filter];
+    if (!executor) {
+        executor = new ScanlineExecutor;
+    }
+    return executor;
+}
+
+void releaseExecutor(const SailfishSilicaBackground* filter)
+{
+    if (!executorRegistry.exists()) {
+        return;
+    }
+
+    ExecutorRegistry* registry = executorRegistry();
+    QMutexLocker locker(&registry->mutex);
+    delete registry->executors.take(filter);
+}
+}
 
 SailfishSilicaBackground::SailfishSilicaBackground(const QString& path) :
     m_whiteLevel(-1.0),
@@ -25,6 +71,7 @@ SailfishSilicaBackground::SailfishSilicaBackground(const QString& path) :
     m_blurRadius = conf.value("blur_radius", m_blurRadius).toInt();
     m_whiteLevel = conf.value("white_level", m_whiteLevel).toDouble();
     m_pixelRatio = conf.value("pixel_ratio", m_pixelRatio).toReal();
+    executorFor(this)->setMaxThreads(conf.value("max_threads", 0).toInt());
 
     // Create output directory if path not empty
     if (!m_outputPath.isEmpty()) {
@@ -39,39 +86,46 @@ SailfishSilicaBackground::SailfishSilicaBackground(const QString& path) :
 
 SailfishSilicaBackground::~SailfishSilicaBackground()
 {
+    releaseExecutor(this);
 }
 
 void SailfishSilicaBackground::curves(QImage* image)
 {
-    int height = image->height();
     int width = image->width();
-
-    for (int y = 0; y < height; ++y) {
-        QRgb* line = reinterpret_cast<QRgb*>(image->scanLine(y));
-        for (int x = 0; x < width; ++x) {
-            QColor color = QColor::fromRgb(line[x]);
-            color.setHsv(color.hue(), color.saturation(), m_curveLookup[color.value()]);
-            line[x] = color.rgb();
+    int bytesPerLine = image->bytesPerLine();
+    uchar* bits = image->bits();
+
+    executorFor(this)->run(*image, [&](int startLine, int lineCount) {
+        for (int y = startLine; y < startLine + lineCount; ++y) {
+            QRgb* line = reinterpret_cast<QRgb*>(bits + y * bytesPerLine);
+            for (int x = 0; x < width; ++x) {
+                QColor color = QColor::fromRgb(line[x]);
+                color.setHsv(color.hue(), color.saturation(), m_curveLookup[color.value()]);
+                line[x] = color.rgb();
+            }
         }
-    }
+    });
 }
 
 void SailfishSilicaBackground::darken(QImage* image) 
 {
     const double darkenFactor = 0.85;
-    int height = image->height();
     int width = image->width();
-
-    for (int y = 0; y < height; ++y) {
-        QRgb* line = reinterpret_cast<QRgb*>(image->scanLine(y));
-        for (int x = 0; x < width; ++x) {
-            QRgb pixel = line[x];
-            int r = qRed(pixel) * darkenFactor;
-            int g = qGreen(pixel) * darkenFactor;
-            int b = qBlue(pixel) * darkenFactor;
-            line[x] = qRgb(r, g, b);
+    int bytesPerLine = image->bytesPerLine();
+    uchar* bits = image->bits();
+
+    executorFor(this)->run(*image, [&](int startLine, int lineCount) {
+        for (int y = startLine; y < startLine + lineCount; ++y) {
+            QRgb* line = reinterpret_cast<QRgb*>(bits + y * bytesPerLine);
+            for (int x = 0; x < width; ++x) {
+                QRgb pixel = line[x];
+                int r = qRed(pixel) * darkenFactor;
+                int g = qGreen(pixel) * darkenFactor;
+                int b = qBlue(pixel) * darkenFactor;
+                line[x] = qRgb(r, g, b);
+            }
         }
-    }
+    });
 }
 
 void SailfishSilicaBackground::lighten(QImage* image)
@@ -82,55 +136,69 @@ void SailfishSilicaBackground::lighten(QImage* image)
 void SailfishSilicaBackground::darkenMore(QImage* image)
 {
     const double darkenFactor = 0.5;
-    int height = image->height();
     int width = image->width();
-
-    for (int y = 0; y < height; ++y) {
-        QRgb* line = reinterpret_cast<QRgb*>(image->scanLine(y));
-        for (int x = 0; x < width; ++x) {
-            QRgb pixel = line[x];
-            int r = qRed(pixel) * darkenFactor;
-            int g = qGreen(pixel) * darkenFactor;
-            int b = qBlue(pixel) * darkenFactor;
-            line[x] = qRgb(r, g, b);
+    int bytesPerLine = image->bytesPerLine();
+    uchar* bits = image->bits();
+
+    executorFor(this)->run(*image, [&](int startLine, int lineCount) {
+        for (int y = startLine; y < startLine + lineCount; ++y) {
+            QRgb* line = reinterpret_cast<QRgb*>(bits + y * bytesPerLine);
+            for (int x = 0; x < width; ++x) {
+                QRgb pixel = line[x];
+                int r = qRed(pixel) * darkenFactor;
+                int g = qGreen(pixel) * darkenFactor;
+                int b = qBlue(pixel) * darkenFactor;
+                line[x] = qRgb(r, g, b);
+            }
         }
-    }
+    });
 }
 
 void SailfishSilicaBackground::saturate(QImage* image)
 {
     const double saturationFactor = 1.5;
-    int height = image->height();
     int width = image->width();
-
-    for (int y = 0; y < height; ++y) {
-        QRgb* line = reinterpret_cast<QRgb*>(image->scanLine(y));
-        for (int x = 0; x < width; ++x) {
-            QColor color = QColor::fromRgb(line[x]);
-            int saturation = color.saturation() * saturationFactor;
-            saturation = std::min(saturation, 255);
-            color.setHsv(color.hue(), saturation, color.value());
-            line[x] = color.rgb();
+    int bytesPerLine = image->bytesPerLine();
+    uchar* bits = image->bits();
+
+    executorFor(this)->run(*image, [&](int startLine, int lineCount) {
+        for (int y = startLine; y < startLine + lineCount; ++y) {
+            QRgb* line = reinterpret_cast<QRgb*>(bits + y * bytesPerLine);
+            for (int x = 0; x < width; ++x) {
+                QColor color = QColor::fromRgb(line[x]);
+                int saturation = color.saturation() * saturationFactor;
+                saturation = std::min(saturation, 255);
+                color.setHsv(color.hue(), saturation, color.value());
+                line[x] = color.rgb();
+            }
         }
-    }
+    });
 }
 
 void SailfishSilicaBackground::addNoise(QImage* image)
 {
-    int height = image->height();
     int width = image->width();
-
-    for (int y = 0; y < height; ++y) {
-        QRgb* line = reinterpret_cast<QRgb*>(image->scanLine(y));
-        for (int x = 0; x < width; ++x) {
-            int noise = (rand() % 50) - 25;
-            QRgb pixel = line[x];
-            int r = std::clamp(qRed(pixel) + noise, 0, 255);
-            int g = std::clamp(qGreen(pixel) + noise, 0, 255);
-            int b = std::clamp(qBlue(pixel) + noise, 0, 255);
-            line[x] = qRgb(r, g, b);
+    int bytesPerLine = image->bytesPerLine();
+    uchar* bits = image->bits();
+
+    // rand() is not reentrant, so every row gets its own generator state.
+    // Seeding by row keeps the noise independent of how lines are chunked.
+    const quint64 seed = rand();
+
+    executorFor(this)->run(*image, [&](int startLine, int lineCount) {
+        for (int y = startLine; y < startLine + lineCount; ++y) {
+            quint64 state = seed ^ (quint64(y) << 32);
+            QRgb* line = reinterpret_cast<QRgb*>(bits + y * bytesPerLine);
+            for (int x = 0; x < width; ++x) {
+                int noise = int(splitMix64(state) % 50) - 25;
+                QRgb pixel = line[x];
+                int r = std::clamp(qRed(pixel) + noise, 0, 255);
+                int g = std::clamp(qGreen(pixel) + noise, 0, 255);
+                int b = std::clamp(qBlue(pixel) + noise, 0, 255);
+                line[x] = qRgb(r, g, b);
+            }
         }
-    }
+    });
 }
 
 void SailfishSilicaBackground::blur(QImage* image)
@@ -146,8 +214,8 @@ void SailfishSilicaBackground::blur(QImage* image)
     QImage tempImage;
 
     for (int i = 0; i < m_blurRounds; ++i) {
-        blurCalculator.blurAndTranspose(image, &tempImage);
-        blurCalculator.blurAndTranspose(&tempImage, image);
+        blurCalculator.blurAndTranspose(image, &tempImage, executorFor(this));
+        blurCalculator.blurAndTranspose(&tempImage, image, executorFor(this));
     }
 }
 
@@ -196,28 +264,42 @@ void SailfishSilicaBackground::buildBackgroundImageBase(const QImage& inputImage
         QImage& outputImage, const QImage& texture, const QRectF& appRect)
 {
     const double targetWidth = appRect.width() / appScaleFactor();
+    const bool textured = !texture.isNull();
+    IntermediateCache* cache = IntermediateCache::instance();
+
+    // Without a texture the whole image is processed, otherwise it is
+    // cropped to appRect and the texture is overlaid afterwards
+    setWhiteLevel(textured ? 0.4 : 1.0);
+
+    // The white level follows from textured, so the key needs no separate
+    // entry for it. Noise and texture are applied after the cached stage.
+    QByteArray colorKey;
+    if (cache->isEnabled()) {
+        QDataStream colorStream(&colorKey, QIODevice::WriteOnly);
+        colorStream << cache->imageHash(inputImage) << textured << appRect << targetWidth
+                    << m_blurRounds << m_blurRadius << m_blurSigma << m_whiteLevel;
+    }
 
-    if (texture.isNull()) {
-        // No texture is supplied, just process and scale the image
-        setWhiteLevel(1.0);
-        outputImage = inputImage.scaledToWidth(targetWidth);
+    if (!cache->find(IntermediateCache::ColorStage, colorKey, &outputImage)) {
+        outputImage = textured
+                ? inputImage.copy(appRect.toRect()).scaledToWidth(targetWidth)
+                : inputImage.scaledToWidth(targetWidth);
         processAppWallpaper(&outputImage);
-        return;
-    }
 
-    // Scale the image to the target width and overlay the texture
-    setWhiteLevel(0.4);
+        if (textured) {
+            // Scale back to the target size
+            outputImage = outputImage.scaledToWidth(appRect.width(), Qt::SmoothTransformation);
+        }
+        cache->insert(IntermediateCache::ColorStage, colorKey, outputImage);
+    }
 
-    // Process and scale the image
-    outputImage = inputImage.copy(appRect.toRect())
-                           .scaledToWidth(targetWidth);
-    processAppWallpaper(&outputImage);
+    if (!textured) {
+        return;
+    }
 
-    // Final touches: scale to target size and apply effects
-    outputImage = outputImage.scaledToWidth(appRect.width(), Qt::SmoothTransformation);
+    // Final touches: noise and semi-transparent texture overlay
     addNoise(&outputImage);
 
-    // Apply semi-transparent texture overlay
     QPainter painter(&outputImage);
     painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
     painter.setOpacity(0.1);
@@ -274,6 +356,11 @@ void SailfishSilicaBackground::setBlurSigma(double sigma)
     m_blurSigma = sigma;
 }
 
+void SailfishSilicaBackground::setMaxThreads(int threads)
+{
+    executorFor(this)->setMaxThreads(threads);
+}
+
 QString SailfishSilicaBackground::outputPath() const
 {
     return m_outputPath;
@@ -289,42 +376,87 @@ double SailfishSilicaBackground::appScaleFactor() const
     return std::round(m_pixelRatio * 4.0);
 }
 
+QString SailfishSilicaBackground::portraitImagePath(const QString& outputPath,
+        const QString& inputImagePath)
+{
+    return outputPath + QString("/%1ap.jpg").arg(qHash(inputImagePath), 0, 16);
+}
+
 int SailfishSilicaBackground::extractMeanValue(const QImage& image)
 {
-    int totalValue = 0;
+    qint64 totalValue = 0;
+    QMutex totalMutex;
     int height = image.height();
     int width = image.width();
-    for (int y = 0; y < height; ++y) {
-        const QRgb* line = reinterpret_cast<const QRgb*>(image.scanLine(y));
-        for (int x = 0; x < width; ++x) {
-            QColor color = QColor::fromRgb(line[x]);
-            totalValue += color.value();
+    if (height <= 0 || width <= 0) return 0;
+
+    executorFor(this)->run(image, [&](int startLine, int lineCount) {
+        qint64 chunkValue = 0;
+        for (int y = startLine; y < startLine + lineCount; ++y) {
+            const QRgb* line = reinterpret_cast<const QRgb*>(image.scanLine(y));
+            for (int x = 0; x < width; ++x) {
+                QColor color = QColor::fromRgb(line[x]);
+                chunkValue += color.value();
+            }
         }
+        QMutexLocker locker(&totalMutex);
+        totalValue += chunkValue;
+    });
+    return totalValue / (qint64(height) * width);
+}
+
+bool SailfishSilicaBackground::buildPortraitImage(
+        SailfishSilicaBackground* filter, const QImage& inputImage,
+        const QString& inputImagePath, const QImage& texture, const QRectF& appRect,
+        QImage* outputImage)
+{
+    if (inputImage.isNull()) {
+        return false;
     }
-    return totalValue / (height * width);
+
+    // Generate output path with hash
+    filter->m_appImagePath = portraitImagePath(filter->outputPath(), inputImagePath);
+
+    // Process the image
+    filter->buildBackgroundImageBase(inputImage, *outputImage, texture, appRect);
+    return true;
 }
 
 void SailfishSilicaBackground::buildBackgroundImageForPortrait(
         SailfishSilicaBackground* filter, const QImage& inputImage,
         QString inputImagePath, const QImage& texture, const QRectF& appRect)
 {
-    if (inputImage.isNull()) {
+    // Nothing is written for a null input
+    QImage outputImage;
+    if (!buildPortraitImage(filter, inputImage, inputImagePath, texture, appRect, &outputImage)) {
         return;
     }
 
-    // Generate output path with hash
-    QString outputPath = filter->outputPath() + 
-                        QString("/%1ap.jpg").arg(qHash(inputImagePath), 0, 16);
-    filter->m_appImagePath = outputPath;
+    // Save the result with high quality
+    const ImageEncoder::Result result =
+            ImageEncoder::encode(outputImage, filter->m_appImagePath, ImageEncoder::Options());
+    if (!result.ok) {
+        qWarning() << "Failed to write" << result.path << result.errorString;
+    }
+}
 
-    // Create output image
+std::future<ImageEncoder::Result> SailfishSilicaBackground::buildBackgroundImageForPortraitAsync(
+        SailfishSilicaBackground* filter, const QImage& inputImage,
+        QString inputImagePath, const QImage& texture, const QRectF& appRect,
+        const ImageEncoder::Options& options)
+{
+    // Nothing is written for a null input, the result says why
     QImage outputImage;
-    
-    // Process the image
-    filter->buildBackgroundImageBase(inputImage, outputImage, texture, appRect);
+    if (!buildPortraitImage(filter, inputImage, inputImagePath, texture, appRect, &outputImage)) {
+        ImageEncoder::Result result;
+        result.path = portraitImagePath(filter->outputPath(), inputImagePath);
+        result.errorString = QStringLiteral("Input image is null");
+
+        std::promise<ImageEncoder::Result> promise;
+        promise.set_value(result);
+        return promise.get_future();
+    }
 
-    // Save the result with high quality
-    QImageWriter writer(outputPath);
-    writer.setQuality(95);
-    writer.write(outputImage);
+    // Hand the pixels over to the write-behind encoder
+    return ImageEncoder::instance()->enqueue(outputImage, filter->m_appImagePath, options);
 }
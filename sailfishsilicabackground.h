@@ -6,6 +6,8 @@
 #include <QString>
 #include <QRectF>
 
+#include "imageencoder.h"
+
 class SailfishSilicaBackground {
 public:
     // Constructors
@@ -35,21 +37,36 @@ public:
     void setBlurRounds(int rounds);
     void setBlurRadius(int radius); 
     void setBlurSigma(double sigma);
+    void setMaxThreads(int threads);
 
     // Property getters
     QString outputPath() const;
     QString appImagePath() const;
     double appScaleFactor() const;
 
-    // Static helper for portrait mode
+    // Static helpers for portrait mode
+    static QString portraitImagePath(const QString& outputPath,
+        const QString& inputImagePath);
     static void buildBackgroundImageForPortrait(
         SailfishSilicaBackground* filter, const QImage& inputImage,
         QString inputImagePath, const QImage& texture, const QRectF& appRect);
+    // Returns once the image is processed, the encoder writes it in the background
+    static std::future<ImageEncoder::Result> buildBackgroundImageForPortraitAsync(
+        SailfishSilicaBackground* filter, const QImage& inputImage,
+        QString inputImagePath, const QImage& texture, const QRectF& appRect,
+        const ImageEncoder::Options& options = ImageEncoder::Options());
 
 private:
     // Internal image processing
     int extractMeanValue(const QImage& image);
 
+    // Builds the portrait pixels and sets appImagePath, shared by the
+    // portrait helpers. Returns false for a null input.
+    static bool buildPortraitImage(
+        SailfishSilicaBackground* filter, const QImage& inputImage,
+        const QString& inputImagePath, const QImage& texture, const QRectF& appRect,
+        QImage* outputImage);
+
     // Member variables
     QString m_outputPath;
     QString m_appImagePath;
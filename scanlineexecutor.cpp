@@ -0,0 +1,108 @@
+#include "scanlineexecutor.h"
+
+#include <algorithm>
+#include <QList>
+#include <QThread>
+
+namespace {
+// Chunks are sized to stay resident in a typical per-core L2 cache
+const int ChunkBytes = 128 * 1024;
+// Minimum number of chunks per thread, for load balancing on small images
+const int ChunksPerThread = 4;
+}
+
+ScanlineExecutor::ScanlineExecutor(int maxThreads) :
+    m_maxThreads(maxThreads),
+    m_function(nullptr),
+    m_nextChunk(0),
+    m_chunkCount(0),
+    m_linesPerChunk(0),
+    m_height(0)
+{
+    m_threadPool.setMaxThreadCount(std::max(1, threadCount() - 1));
+}
+
+ScanlineExecutor::~ScanlineExecutor()
+{
+    m_threadPool.waitForDone();
+}
+
+void ScanlineExecutor::setMaxThreads(int maxThreads)
+{
+    m_maxThreads = maxThreads;
+    m_threadPool.setMaxThreadCount(std::max(1, threadCount() - 1));
+}
+
+int ScanlineExecutor::maxThreads() const
+{
+    return m_maxThreads;
+}
+
+int ScanlineExecutor::threadCount() const
+{
+    return m_maxThreads > 0 ? m_maxThreads : QThread::idealThreadCount();
+}
+
+void ScanlineExecutor::ChunkTask::run()
+{
+    m_executor->processChunks();
+}
+
+ScanlineExecutor::ChunkTask::ChunkTask(ScanlineExecutor* executor)
+    : QRunnable(),
+      m_executor(executor)
+{
+    setAutoDelete(false);
+}
+
+void ScanlineExecutor::processChunks()
+{
+    // Claim chunks until none are left
+    int chunk;
+    while ((chunk = m_nextChunk.fetchAndAddRelaxed(1)) < m_chunkCount) {
+        int startLine = chunk * m_linesPerChunk;
+        (*m_function)(startLine, std::min(m_linesPerChunk, m_height - startLine));
+    }
+}
+
+void ScanlineExecutor::run(const QImage& image, const LineFunction& function)
+{
+    int width = image.width();
+    int height = image.height();
+    int threads = threadCount();
+
+    if (height <= 0) return;
+
+    // Small images are not worth the threading overhead
+    if (threads <= 1 || width <= 50 || height < 50) {
+        function(0, height);
+        return;
+    }
+
+    int cacheLines = std::max(1, ChunkBytes / std::max(1, image.bytesPerLine()));
+    int balancedLines = std::max(1, height / (threads * ChunksPerThread));
+
+    m_function = &function;
+    m_height = height;
+    m_linesPerChunk = std::min(cacheLines, balancedLines);
+    m_chunkCount = (height + m_linesPerChunk - 1) / m_linesPerChunk;
+    m_nextChunk = 0;
+
+    // Queue workers, the calling thread takes part as well
+    QList<ChunkTask*> tasks;
+    int workerCount = std::min(threads - 1, m_chunkCount - 1);
+    for (int i = 0; i < workerCount; i++) {
+        ChunkTask* task = new ChunkTask(this);
+        tasks.append(task);
+        m_threadPool.start(task, 0);
+    }
+
+    processChunks();
+
+    // Wait for tasks to complete
+    m_threadPool.waitForDone();
+
+    // Cleanup tasks
+    qDeleteAll(tasks);
+    m_function = nullptr;
+}
@@ -0,0 +1,55 @@
+#ifndef SCANLINEEXECUTOR_H
+#define SCANLINEEXECUTOR_H
+
+#include <QAtomicInt>
+#include <QImage>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include <functional>
+
+class ScanlineExecutor {
+public:
+    // Called with the first line and the line count of one chunk
+    typedef std::function<void(int, int)> LineFunction;
+
+    // Constructor - maxThreads <= 0 uses QThread::idealThreadCount()
+    explicit ScanlineExecutor(int maxThreads = 0);
+    ~ScanlineExecutor();
+
+    void setMaxThreads(int maxThreads);
+    int maxThreads() const;
+
+    // Runs function over all lines of image in cache sized chunks,
+    // using the calling thread and up to maxThreads() - 1 workers
+    void run(const QImage& image, const LineFunction& function);
+
+private:
+    // Task class for parallel processing
+    class ChunkTask : public QRunnable {
+    private:
+        ScanlineExecutor* m_executor;
+
+        virtual void run() override;
+
+    public:
+        explicit ChunkTask(ScanlineExecutor* executor);
+    };
+
+    int threadCount() const;
+    void processChunks();
+
+    int m_maxThreads;
+    QThreadPool m_threadPool;
+
+    // State of the run in progress
+    const LineFunction* m_function;
+    QAtomicInt m_nextChunk;
+    int m_chunkCount;
+    int m_linesPerChunk;
+    int m_height;
+
+    Q_DISABLE_COPY(ScanlineExecutor)
+};
+
+#endif // SCANLINEEXECUTOR_H